@@ -1,5 +1,8 @@
 #pragma once
 
+#include <string_view>
+#include <unordered_map>
+
 #include "lua_kit.h"
 
 using namespace std;
@@ -45,10 +48,136 @@ namespace lbson {
         BSON_MAXKEY     = 127,
     };
 
+    //编码后的bson元素视图
+    struct bson_element {
+        bson_type type;
+        string_view key;
+        const uint8_t* head;    //元素起始位置(type)
+        const uint8_t* value;   //值起始位置
+        size_t len;             //值长度
+    };
+
+    template<typename T>
+    inline T read_raw(const uint8_t* data) {
+        T value;
+        memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    inline size_t bson_value_len(bson_type type, const uint8_t* data, size_t size) {
+        size_t len = 0;
+        switch (type) {
+        case bson_type::BSON_MINKEY:
+        case bson_type::BSON_MAXKEY:
+        case bson_type::BSON_NULL:
+        case bson_type::BSON_UNDEFINED:
+            break;
+        case bson_type::BSON_BOOLEAN:
+            len = 1;
+            break;
+        case bson_type::BSON_INT32:
+            len = 4;
+            break;
+        case bson_type::BSON_REAL:
+        case bson_type::BSON_DATE:
+        case bson_type::BSON_INT64:
+        case bson_type::BSON_TIMESTAMP:
+            len = 8;
+            break;
+        case bson_type::BSON_OBJECTID:
+            len = 12;
+            break;
+        case bson_type::BSON_INT128:
+            len = 16;
+            break;
+        case bson_type::BSON_STRING:
+        case bson_type::BSON_JSCODE:
+        case bson_type::BSON_SYMBOL:
+        case bson_type::BSON_DBPOINTER:
+            if (size < 4) throw lua_exception("invalid bson block : string");
+            len = 4 + (size_t)read_raw<uint32_t>(data);
+            //长度前缀包含结尾的'\0'
+            if (len < 5 || len > size || data[len - 1] != 0) {
+                throw lua_exception("invalid bson block : string");
+            }
+            if (type == bson_type::BSON_DBPOINTER) len += 12;
+            break;
+        case bson_type::BSON_DOCUMENT:
+        case bson_type::BSON_ARRAY:
+        case bson_type::BSON_CODEWS:
+            if (size < 4) throw lua_exception("invalid bson block : document");
+            len = read_raw<uint32_t>(data);
+            if (len < 5) throw lua_exception("invalid bson block : document");
+            break;
+        case bson_type::BSON_BINARY:
+            if (size < 4) throw lua_exception("invalid bson block : binary");
+            len = 5 + read_raw<uint32_t>(data);
+            break;
+        case bson_type::BSON_REGEX: {
+                const uint8_t* pattern = (const uint8_t*)memchr(data, 0, size);
+                if (!pattern) throw lua_exception("invalid bson block : regex");
+                const uint8_t* option = (const uint8_t*)memchr(pattern + 1, 0, size - (pattern + 1 - data));
+                if (!option) throw lua_exception("invalid bson block : regex");
+                len = option + 1 - data;
+            }
+            break;
+        default:
+            throw lua_exception("invalid bson type: %d", (int)type);
+        }
+        if (len > size) {
+            throw lua_exception("invalid bson block : value overflow");
+        }
+        return len;
+    }
+
+    //按长度前缀遍历编码后的文档，不做任何解码
+    class bson_iter {
+    public:
+        bson_iter(const uint8_t* doc, size_t size) {
+            if (size < 5) throw lua_exception("invalid bson document");
+            uint32_t len = read_raw<uint32_t>(doc);
+            if (len < 5 || len > size || doc[len - 1] != 0) {
+                throw lua_exception("invalid bson document, length = %d", len);
+            }
+            m_pos = doc + 4;
+            m_end = doc + len - 1;
+        }
+
+        bool next(bson_element& elem) {
+            if (m_pos >= m_end) return false;
+            elem.head = m_pos;
+            elem.type = (bson_type)*m_pos++;
+            if (elem.type == bson_type::BSON_EOO) {
+                throw lua_exception("invalid bson block : eoo");
+            }
+            const uint8_t* kend = (const uint8_t*)memchr(m_pos, 0, m_end - m_pos);
+            if (!kend) throw lua_exception("invalid bson block : cstring");
+            elem.key = string_view((const char*)m_pos, kend - m_pos);
+            elem.value = kend + 1;
+            elem.len = bson_value_len(elem.type, elem.value, m_end - elem.value);
+            m_pos = elem.value + elem.len;
+            return true;
+        }
+
+    private:
+        const uint8_t* m_pos;
+        const uint8_t* m_end;
+    };
+
+    inline bool bson_equal(const bson_element& a, const bson_element& b) {
+        return a.type == b.type && a.len == b.len && memcmp(a.value, b.value, a.len) == 0;
+    }
+
+    class keydict;
     class mgocodec;
+    class bson_dump;
+    class bson_matcher;
     class bson {
     public:
         friend mgocodec;
+        friend keydict;
+        friend bson_dump;
+        friend bson_matcher;
         slice* encode_slice(lua_State* L) {
             m_buff->clean();
             pack_dict(L, 0);
@@ -167,7 +296,433 @@ namespace lbson {
             return 1;
         }
 
+        //比较新旧文档，生成$set/$unset更新文档
+        //diff(old, new, [elem_array], [max_depth])
+        int diff(lua_State* L) {
+            string ohold, nhold;
+            size_t olen = 0, nlen = 0;
+            const uint8_t* odoc = diff_source(L, 1, ohold, olen);
+            const uint8_t* ndoc = diff_source(L, 2, nhold, nlen);
+            diff_ctx ctx;
+            ctx.elem_array = lua_toboolean(L, 3);
+            ctx.max_depth = (int)luaL_optinteger(L, 4, max_bson_depth);
+            if (ctx.max_depth <= 0 || ctx.max_depth > max_bson_depth) {
+                ctx.max_depth = max_bson_depth;
+            }
+            try {
+                if (!diff_keys(odoc, olen) || !diff_keys(ndoc, nlen)) {
+                    throw lua_exception("diff can't update top-level field name with '.' or '$'");
+                }
+                diff_dict(ctx, odoc, olen, ndoc, nlen, "", 1);
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            if (ctx.sets.empty() && ctx.unsets.empty()) {
+                lua_pushnil(L);
+                return 1;
+            }
+            m_buff->clean();
+            m_buff->write<uint8_t>(0);
+            m_buff->write<uint8_t>((uint8_t)bson_type::BSON_DOCUMENT);
+            size_t offset = begin_dict();
+            if (!ctx.sets.empty()) {
+                write_key(bson_type::BSON_DOCUMENT, "$set", 4);
+                size_t soffset = begin_dict();
+                for (auto& [path, elem] : ctx.sets) {
+                    write_key(elem.type, path.c_str(), path.size());
+                    if (elem.len > 0) m_buff->push_data((uint8_t*)elem.value, elem.len);
+                }
+                end_dict(soffset);
+            }
+            if (!ctx.unsets.empty()) {
+                write_key(bson_type::BSON_DOCUMENT, "$unset", 6);
+                size_t uoffset = begin_dict();
+                for (auto& path : ctx.unsets) {
+                    write_key(bson_type::BSON_STRING, path.c_str(), path.size());
+                    write_string("", 0);
+                }
+                end_dict(uoffset);
+            }
+            end_dict(offset);
+            lua_pushlstring(L, (const char*)m_buff->head(), m_buff->size());
+            return 1;
+        }
+
+        //按路径读取编码后文档的字段，只解码目标值
+        //get(buf, "a.b.3.c")，数组下标从0开始
+        int get(lua_State* L) {
+            size_t len = 0;
+            const uint8_t* doc = check_document(L, 1, len);
+            string_view path = check_path(L, 2);
+            bson_path bpath;
+            try {
+                if (!locate_path(doc, len, path, bpath, false)) {
+                    lua_pushnil(L);
+                    return 1;
+                }
+                slice slice((uint8_t*)bpath.elem.value, bpath.elem.len);
+                unpack_value(L, &slice, bpath.elem.type);
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            return 1;
+        }
+
+        //按路径修改编码后文档的字段，返回新的编码串
+        //等长的值直接覆盖，变长的值拼接并修正所有外层文档长度，value为nil时删除字段
+        //目标为int32/int64/double/bool/date/objectid且lua值可以表示时保持原类型，否则按普通编码改变类型
+        int set(lua_State* L) {
+            size_t len = 0;
+            const uint8_t* data = (const uint8_t*)lua_tolstring(L, 1, nullptr);
+            const uint8_t* doc = check_document(L, 1, len);
+            string_view path = check_path(L, 2);
+            bson_path bpath;
+            try {
+                locate_path(doc, len, path, bpath, true);
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            string value;
+            if (!lua_isnoneornil(L, 3)) {
+                if (!bpath.found || !coerce_value(L, 3, bpath.elem.type, value)) {
+                    m_buff->clean();
+                    lua_pushvalue(L, 3);
+                    pack_one(L, "", 0, 0);
+                    lua_pop(L, 1);
+                    value.assign((const char*)m_buff->head(), m_buff->size());
+                }
+            }
+            string insert;
+            const uint8_t* splice_beg = nullptr;
+            const uint8_t* splice_end = nullptr;
+            try {
+                if (bpath.found) {
+                    const bson_element& elem = bpath.elem;
+                    if (value.empty()) {
+                        if (bpath.parent == bson_type::BSON_ARRAY && elem.value + elem.len + 1 != bpath.docs.back() + read_raw<uint32_t>(bpath.docs.back())) {
+                            throw lua_exception("only the last array element can be removed");
+                        }
+                        splice_beg = elem.head;
+                    } else {
+                        //value为type + 空key + 值，类型字节在拼接后单独覆盖
+                        insert.assign(value, 2, string::npos);
+                        splice_beg = elem.value;
+                    }
+                    splice_end = elem.value + elem.len;
+                } else {
+                    if (value.empty()) {
+                        lua_pushvalue(L, 1);
+                        return 1;
+                    }
+                    insert = build_path(bpath, path, value);
+                    const uint8_t* parent = bpath.docs.back();
+                    splice_beg = splice_end = parent + read_raw<uint32_t>(parent) - 1;
+                }
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            m_buff->clean();
+            size_t total = (doc - data) + len;
+            m_buff->push_data((uint8_t*)data, splice_beg - data);
+            if (!insert.empty()) m_buff->push_data((uint8_t*)insert.data(), insert.size());
+            m_buff->push_data((uint8_t*)splice_end, data + total - splice_end);
+            if (bpath.found && !value.empty()) {
+                m_buff->copy(bpath.elem.head - data, (uint8_t*)value.data(), 1);
+            }
+            int32_t delta = (int32_t)insert.size() - (int32_t)(splice_end - splice_beg);
+            if (delta != 0) {
+                for (const uint8_t* pdoc : bpath.docs) {
+                    uint32_t size = read_raw<uint32_t>(pdoc) + delta;
+                    m_buff->copy(pdoc - data, (uint8_t*)&size, sizeof(uint32_t));
+                }
+            }
+            lua_pushlstring(L, (const char*)m_buff->head(), m_buff->size());
+            return 1;
+        }
+
     protected:
+        struct bson_path {
+            bool found = false;
+            size_t missing = 0;                         //第一个不存在的路径段位置
+            bson_type parent = bson_type::BSON_DOCUMENT;
+            bson_element elem;
+            vector<const uint8_t*> docs;                //路径上的外层文档
+        };
+
+        //按目标字段的定长类型编码lua值，结果为type + 空key + 值
+        bool coerce_value(lua_State* L, int index, bson_type type, string& value) {
+            int vt = lua_type(L, index);
+            char buffer[16] = { 0 };
+            size_t len = 0;
+            switch (type) {
+            case bson_type::BSON_INT32:
+            case bson_type::BSON_INT64:
+            case bson_type::BSON_DATE: {
+                    if (vt != LUA_TNUMBER || !lua_isinteger(L, index)) return false;
+                    int64_t v = lua_tointeger(L, index);
+                    if (type == bson_type::BSON_INT32) {
+                        if (v < INT32_MIN || v > INT32_MAX) return false;
+                        int32_t v32 = (int32_t)v;
+                        memcpy(buffer, &v32, len = sizeof(int32_t));
+                    } else {
+                        //与bson.date一致，lua侧日期单位为秒
+                        if (type == bson_type::BSON_DATE) v *= 1000;
+                        memcpy(buffer, &v, len = sizeof(int64_t));
+                    }
+                }
+                break;
+            case bson_type::BSON_REAL: {
+                    if (vt != LUA_TNUMBER) return false;
+                    double v = lua_tonumber(L, index);
+                    memcpy(buffer, &v, len = sizeof(double));
+                }
+                break;
+            case bson_type::BSON_BOOLEAN:
+                if (vt != LUA_TBOOLEAN) return false;
+                buffer[0] = lua_toboolean(L, index) ? 1 : 0;
+                len = 1;
+                break;
+            case bson_type::BSON_OBJECTID: {
+                    size_t hlen = 0;
+                    if (vt != LUA_TSTRING) return false;
+                    const char* hex = lua_tolstring(L, index, &hlen);
+                    if (hlen != 24) return false;
+                    for (size_t i = 0; i < hlen; ++i) {
+                        if (!((hex[i] >= '0' && hex[i] <= '9') || (hex[i] >= 'a' && hex[i] <= 'f'))) return false;
+                    }
+                    write_objectid(L, buffer, hex);
+                    len = 12;
+                }
+                break;
+            default:
+                return false;
+            }
+            value.assign(1, (char)type).append(1, '\0').append(buffer, len);
+            return true;
+        }
+
+        string_view check_path(lua_State* L, int index) {
+            size_t len = 0;
+            const char* path = luaL_checklstring(L, index, &len);
+            if (len == 0 || path[0] == '.' || path[len - 1] == '.') {
+                luaL_error(L, "Invalid bson path: %s", path);
+            }
+            return string_view(path, len);
+        }
+
+        bool locate_path(const uint8_t* doc, size_t len, string_view path, bson_path& bpath, bool strict) {
+            size_t start = 0;
+            bpath.docs.push_back(doc);
+            while (true) {
+                size_t dot = path.find('.', start);
+                string_view seg = path.substr(start, dot == string_view::npos ? string_view::npos : dot - start);
+                bool found = false;
+                bson_iter iter(doc, len);
+                while (iter.next(bpath.elem)) {
+                    if (bpath.elem.key == seg) {
+                        found = true;
+                        break;
+                    }
+                }
+                if (!found) {
+                    bpath.missing = start;
+                    return false;
+                }
+                if (dot == string_view::npos) {
+                    bpath.found = true;
+                    return true;
+                }
+                bson_type type = bpath.elem.type;
+                if (type != bson_type::BSON_DOCUMENT && type != bson_type::BSON_ARRAY) {
+                    if (strict) {
+                        throw lua_exception("bson path conflict at: %s", string(path.substr(0, dot)).c_str());
+                    }
+                    return false;
+                }
+                doc = bpath.elem.value;
+                len = bpath.elem.len;
+                bpath.parent = type;
+                bpath.docs.push_back(doc);
+                start = dot + 1;
+            }
+        }
+
+        //为缺失的路径段逐层构造内嵌文档，返回需要插入到父文档末尾的元素
+        string build_path(const bson_path& bpath, string_view path, const string& value) {
+            vector<string_view> segs;
+            size_t start = bpath.missing;
+            while (true) {
+                size_t dot = path.find('.', start);
+                if (dot == string_view::npos) {
+                    segs.push_back(path.substr(start));
+                    break;
+                }
+                segs.push_back(path.substr(start, dot - start));
+                start = dot + 1;
+            }
+            if (bpath.parent == bson_type::BSON_ARRAY) {
+                size_t count = 0;
+                bson_element elem;
+                const uint8_t* parent = bpath.docs.back();
+                bson_iter iter(parent, read_raw<uint32_t>(parent));
+                while (iter.next(elem)) count++;
+                char numkey[32];
+                size_t klen = bson_index(numkey, count);
+                if (segs[0] != string_view(numkey, klen)) {
+                    throw lua_exception("bson array index out of range: %s", string(segs[0]).c_str());
+                }
+            }
+            string elem;
+            elem.append(1, value[0]).append(segs.back()).append(1, '\0').append(value, 2, string::npos);
+            for (size_t i = segs.size() - 1; i > 0; --i) {
+                uint32_t size = elem.size() + 5;
+                string sub;
+                sub.append(1, (char)bson_type::BSON_DOCUMENT).append(segs[i - 1]).append(1, '\0');
+                sub.append((const char*)&size, sizeof(uint32_t)).append(elem).append(1, '\0');
+                elem.swap(sub);
+            }
+            return elem;
+        }
+
+        struct diff_ctx {
+            bool elem_array = false;
+            int max_depth = max_bson_depth;
+            vector<pair<string, bson_element>> sets;
+            vector<string> unsets;
+        };
+
+        //支持bson.encode的结果，以及bson.pairs等返回的内嵌文档值
+        const uint8_t* check_document(lua_State* L, int index, size_t& len) {
+            const uint8_t* data = (const uint8_t*)luaL_checklstring(L, index, &len);
+            if (len >= 5 && read_raw<uint32_t>(data) == len) {
+                return data;
+            }
+            if (len >= 7 && data[0] == 0 && data[1] == (uint8_t)bson_type::BSON_DOCUMENT && read_raw<uint32_t>(data + 2) == len - 2) {
+                len -= 2;
+                return data + 2;
+            }
+            luaL_error(L, "Argument %d need a bson document", index);
+            return nullptr;
+        }
+
+        const uint8_t* diff_source(lua_State* L, int index, string& hold, size_t& len) {
+            if (lua_type(L, index) != LUA_TTABLE) {
+                return check_document(L, index, len);
+            }
+            m_buff->clean();
+            lua_pushvalue(L, index);
+            pack_dict(L, 0);
+            lua_pop(L, 1);
+            const uint8_t* data = m_buff->data(&len);
+            hold.assign((const char*)data, len);
+            return (const uint8_t*)hold.data();
+        }
+
+        string diff_path(const string& prefix, string_view key) {
+            if (prefix.empty()) return string(key);
+            string path;
+            path.reserve(prefix.size() + key.size() + 1);
+            path.append(prefix).append(1, '.').append(key);
+            return path;
+        }
+
+        //字段名包含'.'或以'$'开头时无法用路径表达，只能整体替换外层文档
+        bool diff_key(string_view key) {
+            return key.find('.') == string_view::npos && (key.empty() || key[0] != '$');
+        }
+
+        bool diff_keys(const uint8_t* doc, size_t len) {
+            bson_element elem;
+            bson_iter iter(doc, len);
+            while (iter.next(elem)) {
+                if (!diff_key(elem.key)) return false;
+            }
+            return true;
+        }
+
+        void diff_value(diff_ctx& ctx, const bson_element& oelem, const bson_element& nelem, const string& path, int depth) {
+            if (bson_equal(oelem, nelem)) return;
+            if (depth < ctx.max_depth && oelem.type == nelem.type) {
+                if (nelem.type == bson_type::BSON_DOCUMENT && diff_keys(oelem.value, oelem.len) && diff_keys(nelem.value, nelem.len)) {
+                    diff_dict(ctx, oelem.value, oelem.len, nelem.value, nelem.len, path, depth + 1);
+                    return;
+                }
+                if (nelem.type == bson_type::BSON_ARRAY && ctx.elem_array && diff_array(ctx, oelem, nelem, path, depth + 1)) {
+                    return;
+                }
+            }
+            ctx.sets.emplace_back(path, nelem);
+        }
+
+        //数组按下标比较，新数组变短时$unset只能置null，返回false整体替换
+        bool diff_array(diff_ctx& ctx, const bson_element& oelem, const bson_element& nelem, const string& prefix, int depth) {
+            bson_element elem;
+            vector<bson_element> olds, news;
+            bson_iter oiter(oelem.value, oelem.len);
+            while (oiter.next(elem)) olds.push_back(elem);
+            bson_iter niter(nelem.value, nelem.len);
+            while (niter.next(elem)) news.push_back(elem);
+            if (news.size() < olds.size()) return false;
+            char numkey[32];
+            for (size_t i = 0; i < news.size(); ++i) {
+                size_t len = bson_index(numkey, i);
+                string path = diff_path(prefix, string_view(numkey, len));
+                if (i < olds.size()) {
+                    diff_value(ctx, olds[i], news[i], path, depth);
+                } else {
+                    ctx.sets.emplace_back(path, news[i]);
+                }
+            }
+            return true;
+        }
+
+        void diff_dict(diff_ctx& ctx, const uint8_t* odoc, size_t olen, const uint8_t* ndoc, size_t nlen, const string& prefix, int depth) {
+            bson_element elem;
+            vector<bson_element> olds;
+            bson_iter oiter(odoc, olen);
+            while (oiter.next(elem)) olds.push_back(elem);
+            vector<bool> matched(olds.size(), false);
+            unordered_map<string_view, size_t> keys;
+            size_t hint = 0;
+            bson_iter niter(ndoc, nlen);
+            while (niter.next(elem)) {
+                string path = diff_path(prefix, elem.key);
+                //同一来源的文档字段顺序通常一致，优先按位置匹配
+                size_t pos = olds.size();
+                if (hint < olds.size() && olds[hint].key == elem.key) {
+                    pos = hint;
+                } else {
+                    if (keys.empty()) {
+                        for (size_t i = 0; i < olds.size(); ++i) keys.emplace(olds[i].key, i);
+                    }
+                    auto it = keys.find(elem.key);
+                    if (it != keys.end()) pos = it->second;
+                }
+                if (pos == olds.size()) {
+                    ctx.sets.emplace_back(path, elem);
+                    continue;
+                }
+                hint = pos + 1;
+                matched[pos] = true;
+                diff_value(ctx, olds[pos], elem, path, depth);
+            }
+            for (size_t i = 0; i < olds.size(); ++i) {
+                if (!matched[i]) ctx.unsets.push_back(diff_path(prefix, olds[i].key));
+            }
+        }
+
+        size_t begin_dict() {
+            size_t offset = m_buff->size();
+            m_buff->write<uint32_t>(0);
+            return offset;
+        }
+
+        void end_dict(size_t offset) {
+            m_buff->write<uint8_t>(0);
+            uint32_t size = m_buff->size() - offset;
+            m_buff->copy(offset, (uint8_t*)&size, sizeof(uint32_t));
+        }
+
         int make_bson_value(lua_State *L, bson_type type, uint8_t* value, size_t len) {
             m_buff->clean();
             m_buff->write<uint8_t>(0);
@@ -185,23 +740,33 @@ namespace lbson {
             return sprintf(str, "%zd", i);
         }
 
-        void pack_date(lua_State* L) {
+        //pack_*以写入器W为模板参数，bson自身为标准格式的写入器，keydict为紧凑格式的写入器
+        //W需要提供：write_key/write_int/write_length/write_cstring/write_string/write_raw/begin_dict/end_dict
+        //数组元素的key为nullptr，klen为下标
+        template<typename W>
+        void pack_date(W* w, lua_State* L) {
             lua_getfield(L, -1, "date");
-            m_buff->write<uint64_t>(lua_tointeger(L, -1) * 1000);
+            w->write_int(bson_type::BSON_DATE, lua_tointeger(L, -1) * 1000);
             lua_pop(L, 1);
         }
 
-        void pack_int64(lua_State* L) {
+        template<typename W>
+        void pack_int64(W* w, lua_State* L, bson_type type) {
             lua_getfield(L, -1, "value");
-            m_buff->write<uint64_t>(lua_tointeger(L, -1));
+            if (type == bson_type::BSON_TIMESTAMP) {
+                m_buff->write<uint64_t>(lua_tointeger(L, -1));
+            } else {
+                w->write_int(type, lua_tointeger(L, -1));
+            }
             lua_pop(L, 1);
         }
 
-        void pack_string(lua_State* L) {
+        template<typename W>
+        void pack_string(W* w, lua_State* L, bson_type type) {
             size_t data_len;
             lua_getfield(L, -1, "value");
             const char* data = lua_tolstring(L, -1, &data_len);
-            m_buff->push_data((uint8_t*)data, data_len);
+            w->write_raw(type, (const uint8_t*)data, data_len);
             lua_pop(L, 1);
         }
 
@@ -216,26 +781,28 @@ namespace lbson {
             lua_pop(L, 1);
         }
 
-        void pack_binary(lua_State* L) {
+        template<typename W>
+        void pack_binary(W* w, lua_State* L) {
             lua_guard g(L);
             size_t bin_len;
             lua_getfield(L, -1, "binary");
             const char* bin = lua_tolstring(L, -1, &bin_len);
             lua_getfield(L, -2, "subtype");
-            m_buff->write<uint32_t>(bin_len);
+            w->write_length(bin_len);
             m_buff->write<uint8_t>(lua_tointeger(L, -1));
             m_buff->push_data((uint8_t*)bin, bin_len);
         }
 
-        void pack_regex(lua_State* L) {
+        template<typename W>
+        void pack_regex(W* w, lua_State* L) {
             lua_guard g(L);
             size_t regex_len;
             lua_getfield(L, -1, "pattern");
             const char* pattern = lua_tolstring(L, -1, &regex_len);
-            write_cstring(pattern, regex_len);
+            w->write_cstring(pattern, regex_len);
             lua_getfield(L, -2, "option");
             const char* option = lua_tolstring(L, -1, &regex_len);
-            write_cstring(option, regex_len);
+            w->write_cstring(option, regex_len);
         }
         
         void write_cstring(const char* buf, size_t len) {
@@ -250,13 +817,28 @@ namespace lbson {
 
         void write_key(bson_type type, const char* key, size_t klen) {
             m_buff->write<uint8_t>((uint8_t)type);
+            if (key == nullptr) {
+                char numkey[32];
+                write_cstring(numkey, bson_index(numkey, klen));
+                return;
+            }
             write_cstring(key, klen);
         }
 
-        template<typename T>
-        void write_pair(bson_type type, const char* key, size_t klen, T value) {
-            write_key(type, key, klen);
-            m_buff->write(value);
+        void write_int(bson_type type, int64_t value) {
+            if (type == bson_type::BSON_INT32) {
+                m_buff->write<int32_t>(value);
+            } else {
+                m_buff->write<int64_t>(value);
+            }
+        }
+
+        void write_length(size_t len) {
+            m_buff->write<uint32_t>(len);
+        }
+
+        void write_raw(bson_type type, const uint8_t* data, size_t len) {
+            m_buff->push_data((uint8_t*)data, len);
         }
 
         template<typename T>
@@ -291,39 +873,35 @@ namespace lbson {
             }
         }
 
-        void write_number(lua_State *L, const char* key, size_t klen) {
+        template<typename W>
+        void write_number(W* w, lua_State *L, const char* key, size_t klen) {
             if (lua_isinteger(L, -1)) {
                 int64_t v = lua_tointeger(L, -1);
-                if (v >= INT32_MIN && v <= INT32_MAX) {
-                    write_pair<int32_t>(bson_type::BSON_INT32, key, klen, v);
-                } else {
-                    write_pair<int64_t>(bson_type::BSON_INT64, key, klen, v);
-                }
+                bson_type type = (v >= INT32_MIN && v <= INT32_MAX) ? bson_type::BSON_INT32 : bson_type::BSON_INT64;
+                w->write_key(type, key, klen);
+                w->write_int(type, v);
             } else {
-                write_pair<double>(bson_type::BSON_REAL, key, klen, lua_tonumber(L, -1));
+                w->write_key(bson_type::BSON_REAL, key, klen);
+                m_buff->write<double>(lua_tonumber(L, -1));
             }
         }
 
-        void pack_array(lua_State *L, int depth, size_t len) {
+        template<typename W>
+        void pack_array(W* w, lua_State *L, int depth, size_t len) {
             // length占位
-            char numkey[32];
-            size_t offset = m_buff->size();
-            m_buff->write<uint32_t>(0);
+            size_t offset = w->begin_dict();
             for (size_t i = 1; i <= len; i++) {
                 lua_rawgeti(L, -1, i);
-                size_t len = bson_index(numkey, i - 1);
-                pack_one(L, numkey, len, depth);
+                pack_one(w, L, nullptr, i - 1, depth);
                 lua_pop(L, 1);
             }
-            m_buff->write<uint8_t>(0);
-            uint32_t size = m_buff->size() - offset;
-            m_buff->copy(offset, (uint8_t*)&size, sizeof(uint32_t));
+            w->end_dict(offset);
         }
 
-        void pack_order(lua_State* L, int depth, size_t len) {
+        template<typename W>
+        void pack_order(W* w, lua_State* L, int depth, size_t len) {
             size_t sz;
-            size_t offset = m_buff->size();
-            m_buff->write<uint32_t>(0);
+            size_t offset = w->begin_dict();
             for (int i = 1; i + 1 <= len; i += 2) {
                 lua_rawgeti(L, -1, i);
                 if (!lua_isstring(L, -1)) {
@@ -331,12 +909,10 @@ namespace lbson {
                 }
                 const char* key = lua_tolstring(L, -1, &sz);
                 lua_rawgeti(L, -2, i + 1);
-                pack_one(L, key, sz, depth);
+                pack_one(w, L, key, sz, depth);
                 lua_pop(L, 2);
             }
-            m_buff->write<uint8_t>(0);
-            uint32_t size = m_buff->size() - offset;
-            m_buff->copy(offset, (uint8_t*)&size, sizeof(uint32_t));
+            w->end_dict(offset);
         }
 
         bson_type check_doctype(lua_State *L, size_t raw_len) {
@@ -358,55 +934,57 @@ namespace lbson {
             return cur_len == raw_len ? bson_type::BSON_ARRAY : bson_type::BSON_DOCUMENT;
         }
 
-        void pack_table(lua_State *L, const char* key, size_t len, int depth) {
+        template<typename W>
+        void pack_table(W* w, lua_State *L, const char* key, size_t len, int depth) {
             if (depth > max_bson_depth) {
                 luaL_error(L, "Too depth while encoding bson");
             }
             int raw_len = lua_rawlen(L, -1);
             bson_type type = check_doctype(L, raw_len);
-            write_key(type, key, len);
+            w->write_key(type, key, len);
             if (type == bson_type::BSON_DOCUMENT) {
                 lua_getfield(L, -1, "__order");
                 auto no_order = lua_isnil(L, -1);
                 lua_pop(L, 1);
                 if (no_order) {
-                    pack_dict(L, depth);
+                    pack_dict(w, L, depth);
                 } else {
                     lua_pushnil(L);
                     lua_setfield(L, -2, "__order");
-                    pack_order(L, depth, raw_len);
+                    pack_order(w, L, depth, raw_len);
                 }
             } else {
-                pack_array(L, depth, raw_len);
+                pack_array(w, L, depth, raw_len);
             }
         }
 
-        void pack_bson_value(lua_State* L, bson_type type){
+        template<typename W>
+        void pack_bson_value(W* w, lua_State* L, bson_type type){
             switch(type) {
             case bson_type::BSON_MINKEY:
             case bson_type::BSON_MAXKEY:
             case bson_type::BSON_NULL:
                 break;
             case bson_type::BSON_BINARY:
-                pack_binary(L);
+                pack_binary(w, L);
                 break;
             case bson_type::BSON_DATE:
-                pack_date(L);
+                pack_date(w, L);
                 break;
             case bson_type::BSON_INT64:
             case bson_type::BSON_TIMESTAMP:
-                pack_int64(L);
+                pack_int64(w, L, type);
                 break;
             case bson_type::BSON_ARRAY:
             case bson_type::BSON_JSCODE:
             case bson_type::BSON_DOCUMENT:
-                pack_string(L);
+                pack_string(w, L, type);
                 break;
             case bson_type::BSON_OBJECTID:
                 pack_objectid(L);
                 break;
             case bson_type::BSON_REGEX:
-                pack_regex(L);
+                pack_regex(w, L);
                 break;
             default:
                 luaL_error(L, "Invalid value type : %d", (int)type);
@@ -414,24 +992,30 @@ namespace lbson {
         }
 
         void pack_one(lua_State *L, const char* key, size_t klen, int depth) {
+            pack_one(this, L, key, klen, depth);
+        }
+
+        template<typename W>
+        void pack_one(W* w, lua_State *L, const char* key, size_t klen, int depth) {
             int vt = lua_type(L, -1);
             switch(vt) {
             case LUA_TNUMBER:
-                write_number(L, key, klen);
+                write_number(w, L, key, klen);
                 break;
             case LUA_TBOOLEAN:
-                write_pair<bool>(bson_type::BSON_BOOLEAN, key, klen, lua_toboolean(L, -1));
+                w->write_key(bson_type::BSON_BOOLEAN, key, klen);
+                m_buff->write<bool>(lua_toboolean(L, -1));
                 break;
             case LUA_TTABLE: {
                     lua_getfield(L, -1, "__type");
                     if (lua_type(L, -1) == LUA_TNUMBER) {
                         bson_type type = (bson_type)lua_tointeger(L, -1);
-                        write_key(type, key, klen);
+                        w->write_key(type, key, klen);
                         lua_pop(L, 1);
-                        pack_bson_value(L, type);
+                        pack_bson_value(w, L, type);
                     } else {
                         lua_pop(L, 1);
-                        pack_table(L, key, klen, depth + 1);
+                        pack_table(w, L, key, klen, depth + 1);
                     }
                 }
                 break;
@@ -439,11 +1023,11 @@ namespace lbson {
                 size_t sz;
                 const char* buf = lua_tolstring(L, -1, &sz);
                 if (sz > 2 && buf[0] == 0 && buf[1] != 0) {
-                    write_key((bson_type)buf[1], key, klen);
-                    m_buff->push_data((uint8_t*)(buf + 2), sz - 2);
+                    w->write_key((bson_type)buf[1], key, klen);
+                    w->write_raw((bson_type)buf[1], (const uint8_t*)(buf + 2), sz - 2);
                 } else {
-                    write_key(bson_type::BSON_STRING, key, klen);
-                        write_string(buf, sz);
+                    w->write_key(bson_type::BSON_STRING, key, klen);
+                        w->write_string(buf, sz);
                     }
                 }
                 break;
@@ -455,34 +1039,37 @@ namespace lbson {
             }
         }
 
-        void pack_dict_data(lua_State *L, int depth, int kt) {
+        template<typename W>
+        void pack_dict_data(W* w, lua_State *L, int depth, int kt) {
             if (kt == LUA_TSTRING) {
                 size_t sz;
                 const char* buf = lua_tolstring(L, -2, &sz);
-                pack_one(L, buf, sz, depth);
+                pack_one(w, L, buf, sz, depth);
                 return;
             }
             if (lua_isinteger(L, -2)){
                 char numkey[32];
                 size_t len = bson_index(numkey, lua_tointeger(L, -2));
-                pack_one(L, numkey, len, depth);
+                pack_one(w, L, numkey, len, depth);
                 return;
             }
             luaL_error(L, "Invalid key type : %s", lua_typename(L, kt));
         }
 
         void pack_dict(lua_State *L, int depth) {
+            pack_dict(this, L, depth);
+        }
+
+        template<typename W>
+        void pack_dict(W* w, lua_State *L, int depth) {
             // length占位
-            size_t offset = m_buff->size();
-            m_buff->write<uint32_t>(0);
+            size_t offset = w->begin_dict();
             lua_pushnil(L);
             while(lua_next(L, -2) != 0) {
-                pack_dict_data(L, depth, lua_type(L, -2));
+                pack_dict_data(w, L, depth, lua_type(L, -2));
                 lua_pop(L, 1);
             }
-            m_buff->write<uint8_t>(0);
-            uint32_t size = m_buff->size() - offset;
-            m_buff->copy(offset, (uint8_t*)&size, sizeof(uint32_t));
+            w->end_dict(offset);
         }
 
         const char* read_bytes(lua_State* L, slice* slice, size_t sz) {
@@ -536,6 +1123,75 @@ namespace lbson {
             }
         }
 
+        void unpack_value(lua_State* L, slice* slice, bson_type bt) {
+            size_t klen = 0;
+            switch (bt) {
+            case bson_type::BSON_REAL:
+                lua_pushnumber(L, read_val<double>(L, slice));
+                break;
+            case bson_type::BSON_BOOLEAN:
+                lua_pushboolean(L, read_val<bool>(L, slice));
+                break;
+            case bson_type::BSON_INT32:
+                lua_pushinteger(L, read_val<int32_t>(L, slice));
+                break;
+            case bson_type::BSON_DATE:
+                lua_pushinteger(L, read_val<int64_t>(L, slice) / 1000);
+                break;
+            case bson_type::BSON_INT64:
+            case bson_type::BSON_TIMESTAMP:
+                lua_pushinteger(L, read_val<int64_t>(L, slice));
+                break;
+            case bson_type::BSON_OBJECTID:
+                read_objectid(L, slice);
+                break;
+            case bson_type::BSON_JSCODE:
+            case bson_type::BSON_STRING:{
+                    const char* s = read_string(L, slice, klen);
+                    lua_pushlstring(L, s, klen);
+                }
+                break;
+            case bson_type::BSON_BINARY: {
+                    lua_createtable(L, 0, 4);
+                    int32_t len = read_val<int32_t>(L, slice);
+                    lua_pushinteger(L, (uint32_t)bt);
+                    lua_setfield(L, -2, "__type");
+                    lua_pushinteger(L, read_val<uint8_t>(L, slice));
+                    lua_setfield(L, -2, "subtype");
+                    const char* s = read_bytes(L, slice, len);
+                    lua_pushlstring(L, s, len);
+                    lua_setfield(L, -2, "binary");
+                }
+                break;
+            case bson_type::BSON_REGEX: {
+                    lua_createtable(L, 0, 4);
+                    lua_pushinteger(L, (uint32_t)bt);
+                    lua_setfield(L, -2, "__type");
+                    lua_pushstring(L, read_cstring(slice, klen));
+                    lua_setfield(L, -2, "pattern");
+                    lua_pushstring(L, read_cstring(slice, klen));
+                    lua_setfield(L, -2, "option");
+                }
+                break;
+            case bson_type::BSON_DOCUMENT:
+                unpack_dict(L, slice, false);
+                break;
+            case bson_type::BSON_ARRAY:
+                unpack_dict(L, slice, true);
+                break;
+            case bson_type::BSON_MINKEY:
+            case bson_type::BSON_MAXKEY:
+            case bson_type::BSON_NULL: {
+                    lua_createtable(L, 0, 2);
+                    lua_pushinteger(L, (uint32_t)bt);
+                    lua_setfield(L, -2, "__type");
+                }
+                break;
+            default:
+                throw lua_exception("invalid bson type: %d", (int)bt);
+            }
+        }
+
         void unpack_dict(lua_State* L, slice* slice, bool isarray) {
             uint32_t sz = read_val<uint32_t>(L, slice);
             if (slice->size() < sz - 4) {
@@ -543,75 +1199,10 @@ namespace lbson {
             }
             lua_createtable(L, 0, 8);
             while (!slice->empty()) {
-                size_t klen = 0;
                 bson_type bt = (bson_type)read_val<uint8_t>(L, slice);
                 if (bt == bson_type::BSON_EOO) break;
                 unpack_key(L, slice, isarray);
-                switch (bt) {
-                case bson_type::BSON_REAL:
-                    lua_pushnumber(L, read_val<double>(L, slice));
-                    break;
-                case bson_type::BSON_BOOLEAN:
-                    lua_pushboolean(L, read_val<bool>(L, slice));
-                    break;
-                case bson_type::BSON_INT32:
-                    lua_pushinteger(L, read_val<int32_t>(L, slice));
-                    break;
-                case bson_type::BSON_DATE:
-                    lua_pushinteger(L, read_val<int64_t>(L, slice) / 1000);
-                    break;
-                case bson_type::BSON_INT64:
-                case bson_type::BSON_TIMESTAMP:
-                    lua_pushinteger(L, read_val<int64_t>(L, slice));
-                    break;
-                case bson_type::BSON_OBJECTID:
-                    read_objectid(L, slice);
-                    break;
-                case bson_type::BSON_JSCODE:
-                case bson_type::BSON_STRING:{
-                        const char* s = read_string(L, slice, klen);
-                        lua_pushlstring(L, s, klen);
-                    }
-                    break;
-                case bson_type::BSON_BINARY: {
-                        lua_createtable(L, 0, 4);
-                        int32_t len = read_val<int32_t>(L, slice);
-                        lua_pushinteger(L, (uint32_t)bt);
-                        lua_setfield(L, -2, "__type");
-                        lua_pushinteger(L, read_val<uint8_t>(L, slice));
-                        lua_setfield(L, -2, "subtype");
-                        const char* s = read_bytes(L, slice, len);
-                        lua_pushlstring(L, s, len);
-                        lua_setfield(L, -2, "binary");
-                    }
-                    break;
-                case bson_type::BSON_REGEX: {
-                        lua_createtable(L, 0, 4);
-                        lua_pushinteger(L, (uint32_t)bt);
-                        lua_setfield(L, -2, "__type");
-                        lua_pushstring(L, read_cstring(slice, klen));
-                        lua_setfield(L, -2, "pattern");
-                        lua_pushstring(L, read_cstring(slice, klen));
-                        lua_setfield(L, -2, "option");
-                    }
-                    break;
-                case bson_type::BSON_DOCUMENT:
-                    unpack_dict(L, slice, false);
-                    break;
-                case bson_type::BSON_ARRAY:
-                    unpack_dict(L, slice, true);
-                    break;
-                case bson_type::BSON_MINKEY:
-                case bson_type::BSON_MAXKEY:
-                case bson_type::BSON_NULL: {
-                        lua_createtable(L, 0, 2);
-                        lua_pushinteger(L, (uint32_t)bt);
-                        lua_setfield(L, -2, "__type");
-                    }
-                    break;
-                default:
-                    throw lua_exception("invalid bson type: %d", (int)bt);
-                }
+                unpack_value(L, slice, bt);
                 lua_rawset(L, -3);
             }
         }
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <fstream>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "bson.h"
+
+//mongodump输出的.bson文件读取器，文件为连续的bson文档
+namespace lbson {
+    const uint32_t dump_index_magic     = 0x58444942;   //"BIDX"
+    const size_t dump_release_size      = 64 * 1024 * 1024;
+
+    class bson_dump {
+    public:
+        ~bson_dump() {
+            close();
+        }
+
+        void set_bson(bson* bson) {
+            m_bson = bson;
+        }
+
+        bool open(const char* path) {
+            close();
+#ifdef _WIN32
+            m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+            if (m_file == INVALID_HANDLE_VALUE) return false;
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(m_file, &size)) {
+                close();
+                return false;
+            }
+            m_size = size.QuadPart;
+            if (m_size > 0) {
+                m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+                if (m_mapping == NULL) {
+                    close();
+                    return false;
+                }
+                m_data = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+            }
+#else
+            m_fd = ::open(path, O_RDONLY);
+            if (m_fd < 0) return false;
+            struct stat st;
+            if (fstat(m_fd, &st) != 0) {
+                close();
+                return false;
+            }
+            m_size = st.st_size;
+            if (m_size > 0) {
+                void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+                if (data != MAP_FAILED) {
+                    m_data = (const uint8_t*)data;
+                    madvise(data, m_size, MADV_SEQUENTIAL);
+                }
+            }
+#endif
+            if (m_size > 0 && m_data == nullptr) {
+                close();
+                return false;
+            }
+            m_path = path;
+            load_index((m_path + ".idx").c_str());
+            return true;
+        }
+
+        void close() {
+#ifdef _WIN32
+            if (m_data) UnmapViewOfFile(m_data);
+            if (m_mapping) CloseHandle(m_mapping);
+            if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+            m_mapping = NULL;
+            m_file = INVALID_HANDLE_VALUE;
+#else
+            if (m_data) munmap((void*)m_data, m_size);
+            if (m_fd >= 0) ::close(m_fd);
+            m_fd = -1;
+#endif
+            m_data = nullptr;
+            m_size = 0;
+            m_pos = 0;
+            m_index = 0;
+            m_released = 0;
+            m_offsets.clear();
+        }
+
+        size_t size() {
+            return m_size;
+        }
+
+        //当前文档序号，从0开始
+        size_t tell() {
+            return m_index;
+        }
+
+        //文档总数，没有索引时扫描一遍长度前缀建立偏移表
+        size_t count() {
+            build_offsets(SIZE_MAX);
+            return m_offsets.size();
+        }
+
+        bool seek(size_t index) {
+            build_offsets(index);
+            if (index >= m_offsets.size()) return false;
+            m_pos = m_offsets[index];
+            m_index = index;
+#ifndef _WIN32
+            if (m_data) {
+                size_t page = m_pos & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+                madvise((void*)(m_data + page), m_size - page, MADV_SEQUENTIAL);
+                m_released = page;
+            }
+#endif
+            return true;
+        }
+
+        //保存偏移索引到旁路文件，默认为<path>.idx
+        bool save_index(const char* path) {
+            build_offsets(SIZE_MAX);
+            string ipath = (path && path[0]) ? path : m_path + ".idx";
+            ofstream ofs(ipath, ios::binary | ios::trunc);
+            if (!ofs) return false;
+            uint64_t head[3] = { dump_index_magic, m_size, m_offsets.size() };
+            ofs.write((const char*)head, sizeof(head));
+            if (!m_offsets.empty()) {
+                ofs.write((const char*)m_offsets.data(), m_offsets.size() * sizeof(uint64_t));
+            }
+            return ofs.good();
+        }
+
+        //索引文件不可信，任何校验失败都丢弃，退回扫描建立
+        bool load_index(const char* path) {
+            ifstream ifs(path, ios::binary);
+            if (!ifs) return false;
+            uint64_t head[3] = { 0 };
+            if (!ifs.read((char*)head, sizeof(head))) return false;
+            //文件大小不一致说明索引已过期，最小文档为5字节
+            if (head[0] != dump_index_magic || head[1] != m_size || head[2] > m_size / 5) return false;
+            vector<uint64_t> offsets;
+            try {
+                offsets.resize(head[2]);
+            } catch (const exception&) {
+                return false;
+            }
+            if (!offsets.empty() && !ifs.read((char*)offsets.data(), offsets.size() * sizeof(uint64_t))) {
+                return false;
+            }
+            if (ifs.peek() != char_traits<char>::eof()) return false;
+            for (size_t i = 0; i < offsets.size(); ++i) {
+                if (offsets[i] >= m_size || (i > 0 && offsets[i] <= offsets[i - 1])) return false;
+            }
+            m_offsets.swap(offsets);
+            return true;
+        }
+
+        //dump:next([fields])，fields为需要解码的顶层字段列表
+        int next(lua_State* L) {
+            int fields = 2;
+            const uint8_t* doc = nullptr;
+            size_t len = 0;
+            try {
+                doc = next_doc(len);
+                if (doc == nullptr) {
+                    lua_pushnil(L);
+                    return 1;
+                }
+                if (lua_type(L, fields) == LUA_TTABLE) {
+                    project_dict(L, doc, len, fields);
+                } else {
+                    slice slice((uint8_t*)doc, len);
+                    m_bson->unpack_dict(L, &slice, false);
+                }
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            return 1;
+        }
+
+        //读取下一个文档的原始编码，配合bson.get等延迟解码
+        int next_raw(lua_State* L) {
+            size_t len = 0;
+            const uint8_t* doc = nullptr;
+            try {
+                doc = next_doc(len);
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            if (doc == nullptr) {
+                lua_pushnil(L);
+                return 1;
+            }
+            lua_pushlstring(L, (const char*)doc, len);
+            return 1;
+        }
+
+    protected:
+        const uint8_t* next_doc(size_t& len) {
+            if (m_pos >= m_size) return nullptr;
+            if (m_size - m_pos < 5) {
+                throw lua_exception("truncated bson dump at offset %lu", m_pos);
+            }
+            const uint8_t* doc = m_data + m_pos;
+            len = read_raw<uint32_t>(doc);
+            if (len < 5 || len > m_size - m_pos || doc[len - 1] != 0) {
+                throw lua_exception("invalid bson dump document at offset %lu", m_pos);
+            }
+            release_pages(m_released, m_pos);
+            m_pos += len;
+            m_index++;
+            return doc;
+        }
+
+        //释放[from, pos)之间已读过的页面，保持扫描时内存恒定
+        void release_pages(size_t& from, size_t pos) {
+#ifndef _WIN32
+            if (pos < from || pos - from < dump_release_size) return;
+            size_t end = pos & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+            if (end > from) {
+                madvise((void*)(m_data + from), end - from, MADV_DONTNEED);
+                from = end;
+            }
+#endif
+        }
+
+        void build_offsets(size_t index) {
+            if (index < m_offsets.size() || m_data == nullptr) return;
+            size_t pos = 0;
+            if (!m_offsets.empty()) {
+                pos = m_offsets.back();
+                if (m_size - pos < 5) return;
+                uint32_t len = read_raw<uint32_t>(m_data + pos);
+                if (len < 5 || len > m_size - pos) return;
+                pos += len;
+            }
+            //扫描只读取长度前缀，但仍会触及所有页面，同样需要释放
+            size_t released = pos;
+#ifndef _WIN32
+            released &= ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+#endif
+            while (m_size - pos >= 5 && m_offsets.size() <= index) {
+                uint32_t len = read_raw<uint32_t>(m_data + pos);
+                if (len < 5 || len > m_size - pos) break;
+                m_offsets.push_back(pos);
+                pos += len;
+                release_pages(released, pos);
+            }
+        }
+
+        void project_dict(lua_State* L, const uint8_t* doc, size_t len, int fields) {
+            size_t nfield = lua_rawlen(L, fields);
+            vector<string_view> names;
+            for (size_t i = 1; i <= nfield; ++i) {
+                size_t klen = 0;
+                lua_rawgeti(L, fields, i);
+                const char* key = lua_tolstring(L, -1, &klen);
+                if (key) names.emplace_back(key, klen);
+                lua_pop(L, 1);
+            }
+            bson_element elem;
+            bson_iter iter(doc, len);
+            lua_createtable(L, 0, names.size());
+            while (iter.next(elem)) {
+                if (find(names.begin(), names.end(), elem.key) == names.end()) continue;
+                //key在原始数据中以'\0'结尾，可以直接转换
+                if (lua_stringtonumber(L, elem.key.data()) == 0) {
+                    lua_pushlstring(L, elem.key.data(), elem.key.size());
+                }
+                slice slice((uint8_t*)elem.value, elem.len);
+                m_bson->unpack_value(L, &slice, elem.type);
+                lua_rawset(L, -3);
+            }
+        }
+
+    protected:
+        string m_path;
+        size_t m_pos = 0;
+        size_t m_size = 0;
+        size_t m_index = 0;
+        size_t m_released = 0;
+        bson* m_bson = nullptr;
+        const uint8_t* m_data = nullptr;
+        vector<uint64_t> m_offsets;
+#ifdef _WIN32
+        HANDLE m_file = INVALID_HANDLE_VALUE;
+        HANDLE m_mapping = NULL;
+#else
+        int m_fd = -1;
+#endif
+    };
+}
@@ -0,0 +1,618 @@
+#pragma once
+
+#include <deque>
+
+#include "bson.h"
+
+//紧凑格式：字段名替换为字典id，整数和长度使用varint
+//compact := magic varint(version) varint(count) hash cdoc
+//cdoc    := { type key value } 0
+//key     := varint(id + 1) | 0 varint(len) bytes
+//array   := { type value } 0
+namespace lbson {
+    const uint8_t compact_magic = 0xCB;
+    const uint32_t compact_hash_seed = 2166136261u;
+
+    class compact_reader {
+    public:
+        compact_reader(const uint8_t* data, size_t len) : m_pos(data), m_end(data + len) {}
+
+        bool empty() { return m_pos >= m_end; }
+
+        uint8_t read_byte() {
+            if (m_pos >= m_end) throw lua_exception("invalid compact block : overflow");
+            return *m_pos++;
+        }
+
+        const uint8_t* read_bytes(size_t len) {
+            if (len > (size_t)(m_end - m_pos)) {
+                throw lua_exception("invalid compact block : length = %lu", len);
+            }
+            const uint8_t* data = m_pos;
+            m_pos += len;
+            return data;
+        }
+
+        uint64_t read_varint() {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                uint8_t byte = read_byte();
+                value |= (uint64_t)(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) return value;
+            }
+            throw lua_exception("invalid compact block : varint");
+        }
+
+        int64_t read_zigzag() {
+            uint64_t value = read_varint();
+            return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+        }
+
+        string_view read_string() {
+            size_t len = read_varint();
+            return string_view((const char*)read_bytes(len), len);
+        }
+
+    private:
+        const uint8_t* m_pos;
+        const uint8_t* m_end;
+    };
+
+    class keydict {
+    public:
+        friend bson;
+        keydict(uint32_t version) : m_version(version) {}
+        ~keydict() {
+            release_ref();
+        }
+
+        void set_bson(bson* bson) {
+            m_bson = bson;
+        }
+
+        uint32_t version() {
+            return m_version;
+        }
+
+        size_t size() {
+            return m_keys.size();
+        }
+
+        //声明或从样本中学习字段名，id只追加不变
+        uint32_t add_key(string_view key) {
+            auto it = m_ids.find(key);
+            if (it != m_ids.end()) return it->second;
+            uint32_t id = m_keys.size();
+            m_keys.emplace_back(key);
+            m_ids.emplace(m_keys.back(), id);
+            //每个前缀的字段名FNV-1a摘要，写入头部用于校验两端字典一致
+            uint32_t hash = m_hashes.back();
+            for (char c : key) hash = (hash ^ (uint8_t)c) * 16777619u;
+            m_hashes.push_back((hash ^ 0xff) * 16777619u);
+            release_ref();
+            return id;
+        }
+
+        //会直接抛出lua错误的参数检查，在分配keydict之前完成
+        static void check_keys(lua_State* L, int index) {
+            if (lua_type(L, index) != LUA_TTABLE) return;
+            size_t len = lua_rawlen(L, index);
+            for (size_t i = 1; i <= len; ++i) {
+                lua_rawgeti(L, index, i);
+                if (!lua_isstring(L, -1)) luaL_error(L, "keydict key %d need a string", (int)i);
+                lua_pop(L, 1);
+            }
+        }
+
+        void declare(lua_State* L, int index) {
+            if (lua_type(L, index) != LUA_TTABLE) return;
+            size_t len = lua_rawlen(L, index);
+            for (size_t i = 1; i <= len; ++i) {
+                size_t klen = 0;
+                lua_rawgeti(L, index, i);
+                const char* key = lua_tolstring(L, -1, &klen);
+                if (key) add_key(string_view(key, klen));
+                lua_pop(L, 1);
+            }
+        }
+
+        //dict:learn(doc)，doc为lua表或编码后的bson
+        int learn(lua_State* L) {
+            string hold;
+            size_t len = 0;
+            const uint8_t* doc = m_bson->diff_source(L, 2, hold, len);
+            try {
+                learn_dict(doc, len);
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            lua_pushinteger(L, m_keys.size());
+            return 1;
+        }
+
+        //导出字段名，用于其他进程重建相同的字典
+        int keys(lua_State* L) {
+            lua_createtable(L, m_keys.size(), 0);
+            for (size_t i = 0; i < m_keys.size(); ++i) {
+                lua_pushlstring(L, m_keys[i].data(), m_keys[i].size());
+                lua_rawseti(L, -2, i + 1);
+            }
+            return 1;
+        }
+
+        //直接从lua表编码为紧凑格式，语义与bson::pack_dict一致
+        int encode(lua_State* L) {
+            luaL_checktype(L, 2, LUA_TTABLE);
+            luabuf* buff = m_bson->m_buff;
+            buff->clean();
+            write_header();
+            lua_pushvalue(L, 2);
+            try {
+                m_bson->pack_dict(this, L, 0);
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            lua_pop(L, 1);
+            lua_pushlstring(L, (const char*)buff->head(), buff->size());
+            return 1;
+        }
+
+        int frombson(lua_State* L) {
+            size_t len = 0;
+            const uint8_t* doc = m_bson->check_document(L, 2, len);
+            return push_compact(L, doc, len);
+        }
+
+        int tobson(lua_State* L) {
+            compact_reader reader = check_compact(L, 2);
+            luabuf* buff = m_bson->m_buff;
+            buff->clean();
+            try {
+                compact_to_dict(reader, 0);
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            lua_pushlstring(L, (const char*)buff->head(), buff->size());
+            return 1;
+        }
+
+        int decode(lua_State* L) {
+            compact_reader reader = check_compact(L, 2);
+            int top = lua_gettop(L);
+            push_keys(L);
+            try {
+                unpack_compact(L, reader, top + 1, false, 0);
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            lua_remove(L, top + 1);
+            return 1;
+        }
+
+    protected:
+        //m_L为主线程，注册表在同一虚拟机的所有协程间共享
+        void release_ref() {
+            if (m_L && m_ref != LUA_NOREF) {
+                luaL_unref(m_L, LUA_REGISTRYINDEX, m_ref);
+                m_ref = LUA_NOREF;
+            }
+        }
+
+        //字段名预先转换为lua值，解码时直接引用
+        void push_keys(lua_State* L) {
+            if (m_ref != LUA_NOREF) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, m_ref);
+                return;
+            }
+            if (m_L == nullptr) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+                m_L = lua_tothread(L, -1);
+                lua_pop(L, 1);
+            }
+            lua_createtable(L, m_keys.size(), 0);
+            for (size_t i = 0; i < m_keys.size(); ++i) {
+                if (lua_stringtonumber(L, m_keys[i].c_str()) == 0) {
+                    lua_pushlstring(L, m_keys[i].data(), m_keys[i].size());
+                }
+                lua_rawseti(L, -2, i + 1);
+            }
+            lua_pushvalue(L, -1);
+            m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+
+        compact_reader check_compact(lua_State* L, int index) {
+            size_t len = 0;
+            const uint8_t* data = (const uint8_t*)luaL_checklstring(L, index, &len);
+            compact_reader reader(data, len);
+            try {
+                if (reader.read_byte() != compact_magic) {
+                    throw lua_exception("invalid compact document");
+                }
+                uint64_t version = reader.read_varint();
+                if (version != m_version) {
+                    throw lua_exception("keydict version mismatch: %d != %d", (int)version, (int)m_version);
+                }
+                //id只追加，字段较少的旧数据前缀一致即可解码，前缀不同会导致id错位，必须拒绝
+                uint64_t count = reader.read_varint();
+                uint32_t hash = read_raw<uint32_t>(reader.read_bytes(sizeof(uint32_t)));
+                if (count > m_keys.size() || hash != m_hashes[count]) {
+                    throw lua_exception("keydict keys mismatch: %d keys != %d keys", (int)count, (int)m_keys.size());
+                }
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            return reader;
+        }
+
+        void learn_dict(const uint8_t* doc, size_t len) {
+            bson_element elem;
+            bson_iter iter(doc, len);
+            while (iter.next(elem)) {
+                add_key(elem.key);
+                learn_value(elem);
+            }
+        }
+
+        void learn_value(const bson_element& elem) {
+            if (elem.type == bson_type::BSON_DOCUMENT) {
+                learn_dict(elem.value, elem.len);
+            } else if (elem.type == bson_type::BSON_ARRAY) {
+                bson_element sub;
+                bson_iter iter(elem.value, elem.len);
+                while (iter.next(sub)) learn_value(sub);
+            }
+        }
+
+        int push_compact(lua_State* L, const uint8_t* doc, size_t len) {
+            luabuf* buff = m_bson->m_buff;
+            buff->clean();
+            write_header();
+            try {
+                dict_to_compact(doc, len, false);
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            lua_pushlstring(L, (const char*)buff->head(), buff->size());
+            return 1;
+        }
+
+        void write_header() {
+            m_bson->m_buff->write<uint8_t>(compact_magic);
+            write_varint(m_version);
+            write_varint(m_keys.size());
+            m_bson->m_buff->write<uint32_t>(m_hashes.back());
+        }
+
+        //bson::pack_*的紧凑格式写入器，编码流程与标准格式共用
+        void write_key(bson_type type, const char* key, size_t klen) {
+            m_bson->m_buff->write<uint8_t>((uint8_t)type);
+            if (key == nullptr) return;
+            auto it = m_ids.find(string_view(key, klen));
+            if (it != m_ids.end()) {
+                write_varint((uint64_t)it->second + 1);
+            } else {
+                write_varint(0);
+                write_bytes(key, klen);
+            }
+        }
+
+        void write_int(bson_type type, int64_t value) {
+            write_zigzag(value);
+        }
+
+        void write_length(size_t len) {
+            write_varint(len);
+        }
+
+        void write_cstring(const char* buf, size_t len) {
+            write_bytes(buf, len);
+        }
+
+        void write_string(const char* buf, size_t len) {
+            write_bytes(buf, len);
+        }
+
+        //已编码为标准bson的值(bson.pairs/bson.int64等)转为紧凑格式
+        void write_raw(bson_type type, const uint8_t* data, size_t len) {
+            if (bson_value_len(type, data, len) != len) {
+                throw lua_exception("invalid bson value, type: %d", (int)type);
+            }
+            bson_element elem = { type, string_view(), data, data, len };
+            value_to_compact(elem);
+        }
+
+        size_t begin_dict() {
+            return 0;
+        }
+
+        void end_dict(size_t offset) {
+            m_bson->m_buff->write<uint8_t>(0);
+        }
+
+        void write_varint(uint64_t value) {
+            luabuf* buff = m_bson->m_buff;
+            while (value >= 0x80) {
+                buff->write<uint8_t>((uint8_t)(value | 0x80));
+                value >>= 7;
+            }
+            buff->write<uint8_t>((uint8_t)value);
+        }
+
+        void write_zigzag(int64_t value) {
+            write_varint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+        }
+
+        void write_bytes(const void* data, size_t len) {
+            write_varint(len);
+            if (len > 0) m_bson->m_buff->push_data((uint8_t*)data, len);
+        }
+
+        void dict_to_compact(const uint8_t* doc, size_t len, bool isarray) {
+            bson_element elem;
+            bson_iter iter(doc, len);
+            while (iter.next(elem)) {
+                write_key(elem.type, isarray ? nullptr : elem.key.data(), elem.key.size());
+                value_to_compact(elem);
+            }
+            end_dict(0);
+        }
+
+        void value_to_compact(const bson_element& elem) {
+            luabuf* buff = m_bson->m_buff;
+            const uint8_t* value = elem.value;
+            switch (elem.type) {
+            case bson_type::BSON_MINKEY:
+            case bson_type::BSON_MAXKEY:
+            case bson_type::BSON_NULL:
+            case bson_type::BSON_UNDEFINED:
+                break;
+            case bson_type::BSON_INT32:
+                write_zigzag(read_raw<int32_t>(value));
+                break;
+            case bson_type::BSON_INT64:
+            case bson_type::BSON_DATE:
+                write_zigzag(read_raw<int64_t>(value));
+                break;
+            case bson_type::BSON_STRING:
+            case bson_type::BSON_JSCODE:
+            case bson_type::BSON_SYMBOL:
+                write_bytes(value + 4, elem.len - 5);
+                break;
+            case bson_type::BSON_BINARY:
+                write_varint(elem.len - 5);
+                buff->write<uint8_t>(value[4]);
+                if (elem.len > 5) buff->push_data((uint8_t*)value + 5, elem.len - 5);
+                break;
+            case bson_type::BSON_REGEX: {
+                    size_t plen = strlen((const char*)value);
+                    write_bytes(value, plen);
+                    write_bytes(value + plen + 1, elem.len - plen - 2);
+                }
+                break;
+            case bson_type::BSON_DOCUMENT:
+                dict_to_compact(value, elem.len, false);
+                break;
+            case bson_type::BSON_ARRAY:
+                dict_to_compact(value, elem.len, true);
+                break;
+            case bson_type::BSON_REAL:
+            case bson_type::BSON_BOOLEAN:
+            case bson_type::BSON_OBJECTID:
+            case bson_type::BSON_TIMESTAMP:
+            case bson_type::BSON_INT128:
+                buff->push_data((uint8_t*)value, elem.len);
+                break;
+            default:
+                throw lua_exception("unsupported compact type: %d", (int)elem.type);
+            }
+        }
+
+        string_view read_key(compact_reader& reader) {
+            uint64_t id = reader.read_varint();
+            if (id == 0) return reader.read_string();
+            if (id > m_keys.size()) {
+                throw lua_exception("invalid compact key id: %d", (int)id);
+            }
+            return m_keys[id - 1];
+        }
+
+        void compact_to_dict(compact_reader& reader, int depth, bool isarray = false) {
+            if (depth > max_bson_depth) {
+                throw lua_exception("Too depth while decoding compact");
+            }
+            char numkey[32];
+            size_t index = 0;
+            size_t offset = m_bson->begin_dict();
+            while (true) {
+                bson_type type = (bson_type)reader.read_byte();
+                if (type == bson_type::BSON_EOO) break;
+                if (isarray) {
+                    size_t klen = m_bson->bson_index(numkey, index++);
+                    m_bson->write_key(type, numkey, klen);
+                } else {
+                    string_view key = read_key(reader);
+                    m_bson->write_key(type, key.data(), key.size());
+                }
+                value_to_bson(reader, type, depth);
+            }
+            m_bson->end_dict(offset);
+        }
+
+        void value_to_bson(compact_reader& reader, bson_type type, int depth) {
+            luabuf* buff = m_bson->m_buff;
+            switch (type) {
+            case bson_type::BSON_MINKEY:
+            case bson_type::BSON_MAXKEY:
+            case bson_type::BSON_NULL:
+            case bson_type::BSON_UNDEFINED:
+                break;
+            case bson_type::BSON_INT32:
+                buff->write<int32_t>((int32_t)reader.read_zigzag());
+                break;
+            case bson_type::BSON_INT64:
+            case bson_type::BSON_DATE:
+                buff->write<int64_t>(reader.read_zigzag());
+                break;
+            case bson_type::BSON_STRING:
+            case bson_type::BSON_JSCODE:
+            case bson_type::BSON_SYMBOL: {
+                    string_view s = reader.read_string();
+                    m_bson->write_string(s.data(), s.size());
+                }
+                break;
+            case bson_type::BSON_BINARY: {
+                    size_t len = reader.read_varint();
+                    buff->write<uint32_t>(len);
+                    buff->write<uint8_t>(reader.read_byte());
+                    if (len > 0) buff->push_data((uint8_t*)reader.read_bytes(len), len);
+                }
+                break;
+            case bson_type::BSON_REGEX: {
+                    string_view pattern = reader.read_string();
+                    m_bson->write_cstring(pattern.data(), pattern.size());
+                    string_view option = reader.read_string();
+                    m_bson->write_cstring(option.data(), option.size());
+                }
+                break;
+            case bson_type::BSON_DOCUMENT:
+                compact_to_dict(reader, depth + 1);
+                break;
+            case bson_type::BSON_ARRAY:
+                compact_to_dict(reader, depth + 1, true);
+                break;
+            case bson_type::BSON_REAL:
+            case bson_type::BSON_BOOLEAN:
+            case bson_type::BSON_OBJECTID:
+            case bson_type::BSON_TIMESTAMP:
+            case bson_type::BSON_INT128: {
+                    size_t len = bson_value_len(type, nullptr, SIZE_MAX);
+                    buff->push_data((uint8_t*)reader.read_bytes(len), len);
+                }
+                break;
+            default:
+                throw lua_exception("unsupported compact type: %d", (int)type);
+            }
+        }
+
+        //直接解码为lua表，语义与bson::unpack_dict一致
+        void unpack_compact(lua_State* L, compact_reader& reader, int keys, bool isarray, int depth) {
+            if (depth > max_bson_depth) {
+                throw lua_exception("Too depth while decoding compact");
+            }
+            lua_createtable(L, 0, 8);
+            lua_Integer index = 1;
+            while (true) {
+                bson_type type = (bson_type)reader.read_byte();
+                if (type == bson_type::BSON_EOO) break;
+                if (isarray) {
+                    lua_pushinteger(L, index++);
+                } else {
+                    uint64_t id = reader.read_varint();
+                    if (id == 0) {
+                        string_view key = reader.read_string();
+                        string skey(key);
+                        if (lua_stringtonumber(L, skey.c_str()) == 0) {
+                            lua_pushlstring(L, key.data(), key.size());
+                        }
+                    } else {
+                        if (id > m_keys.size()) {
+                            throw lua_exception("invalid compact key id: %d", (int)id);
+                        }
+                        lua_rawgeti(L, keys, id);
+                    }
+                }
+                unpack_value(L, reader, type, keys, depth);
+                lua_rawset(L, -3);
+            }
+        }
+
+        void unpack_value(lua_State* L, compact_reader& reader, bson_type type, int keys, int depth) {
+            switch (type) {
+            case bson_type::BSON_REAL: {
+                    double value;
+                    memcpy(&value, reader.read_bytes(sizeof(double)), sizeof(double));
+                    lua_pushnumber(L, value);
+                }
+                break;
+            case bson_type::BSON_BOOLEAN:
+                lua_pushboolean(L, reader.read_byte());
+                break;
+            case bson_type::BSON_INT32:
+            case bson_type::BSON_INT64:
+                lua_pushinteger(L, reader.read_zigzag());
+                break;
+            case bson_type::BSON_DATE:
+                lua_pushinteger(L, reader.read_zigzag() / 1000);
+                break;
+            case bson_type::BSON_TIMESTAMP:
+                lua_pushinteger(L, read_raw<int64_t>(reader.read_bytes(8)));
+                break;
+            case bson_type::BSON_OBJECTID: {
+                    char buffer[32] = { 0 };
+                    static char hextxt[] = "0123456789abcdef";
+                    const uint8_t* text = reader.read_bytes(12);
+                    for (size_t i = 0; i < 12; i++) {
+                        buffer[i * 2] = hextxt[(text[i] >> 4) & 0xf];
+                        buffer[i * 2 + 1] = hextxt[text[i] & 0xf];
+                    }
+                    lua_pushlstring(L, buffer, 24);
+                }
+                break;
+            case bson_type::BSON_JSCODE:
+            case bson_type::BSON_STRING: {
+                    string_view s = reader.read_string();
+                    lua_pushlstring(L, s.data(), s.size());
+                }
+                break;
+            case bson_type::BSON_BINARY: {
+                    lua_createtable(L, 0, 4);
+                    size_t len = reader.read_varint();
+                    lua_pushinteger(L, (uint32_t)type);
+                    lua_setfield(L, -2, "__type");
+                    lua_pushinteger(L, reader.read_byte());
+                    lua_setfield(L, -2, "subtype");
+                    lua_pushlstring(L, (const char*)reader.read_bytes(len), len);
+                    lua_setfield(L, -2, "binary");
+                }
+                break;
+            case bson_type::BSON_REGEX: {
+                    lua_createtable(L, 0, 4);
+                    lua_pushinteger(L, (uint32_t)type);
+                    lua_setfield(L, -2, "__type");
+                    string_view pattern = reader.read_string();
+                    lua_pushlstring(L, pattern.data(), pattern.size());
+                    lua_setfield(L, -2, "pattern");
+                    string_view option = reader.read_string();
+                    lua_pushlstring(L, option.data(), option.size());
+                    lua_setfield(L, -2, "option");
+                }
+                break;
+            case bson_type::BSON_DOCUMENT:
+                unpack_compact(L, reader, keys, false, depth + 1);
+                break;
+            case bson_type::BSON_ARRAY:
+                unpack_compact(L, reader, keys, true, depth + 1);
+                break;
+            case bson_type::BSON_MINKEY:
+            case bson_type::BSON_MAXKEY:
+            case bson_type::BSON_NULL: {
+                    lua_createtable(L, 0, 2);
+                    lua_pushinteger(L, (uint32_t)type);
+                    lua_setfield(L, -2, "__type");
+                }
+                break;
+            default:
+                throw lua_exception("invalid compact type: %d", (int)type);
+            }
+        }
+
+    protected:
+        uint32_t m_version = 0;
+        bson* m_bson = nullptr;
+        vector<uint32_t> m_hashes = { compact_hash_seed };
+        lua_State* m_L = nullptr;
+        int m_ref = LUA_NOREF;
+        deque<string> m_keys;
+        unordered_map<string_view, uint32_t> m_ids;
+    };
+}
@@ -1,6 +1,8 @@
 #define LUA_LIB
 
-#include "bson.h"
+#include "dump.h"
+#include "keydict.h"
+#include "matcher.h"
 
 namespace lbson {
 
@@ -24,6 +26,15 @@ namespace lbson {
     static int objectid(lua_State* L) {
         return tbson.objectid(L);
     }
+    static int diff(lua_State* L) {
+        return tbson.diff(L);
+    }
+    static int get(lua_State* L) {
+        return tbson.get(L);
+    }
+    static int set(lua_State* L) {
+        return tbson.set(L);
+    }
     static int int64(lua_State* L, int64_t value) {
         return tbson.int64(L, value);
     }
@@ -31,6 +42,39 @@ namespace lbson {
         return tbson.date(L, value * 1000);
     }
 
+    static keydict* new_keydict(lua_State* L) {
+        uint32_t version = luaL_optinteger(L, 1, 0);
+        keydict::check_keys(L, 2);
+        keydict* dict = new keydict(version);
+        dict->set_bson(&tbson);
+        dict->declare(L, 2);
+        return dict;
+    }
+
+    static bson_dump* open_dump(const char* path) {
+        bson_dump* dump = new bson_dump();
+        dump->set_bson(&tbson);
+        if (!dump->open(path)) {
+            delete dump;
+            return nullptr;
+        }
+        return dump;
+    }
+
+    static bson_matcher* new_matcher(lua_State* L) {
+        bson_matcher::check_args(L, &tbson, 1, 2);
+        unique_ptr<bson_matcher> matcher = make_unique<bson_matcher>();
+        matcher->set_bson(&tbson);
+        try {
+            matcher->compile(L, 1, 2);
+        } catch (const exception& e){
+            matcher.reset();
+            luaL_error(L, "%s", e.what());
+            return nullptr;
+        }
+        return matcher.release();
+    }
+
     static void init_static_bson() {
         for (uint32_t i = 0; i < max_bson_index; ++i) {
             char tmp[8];
@@ -49,6 +93,32 @@ namespace lbson {
     luakit::lua_table open_lbson(lua_State* L) {
         luakit::kit_state kit_state(L);
         tbson.set_buff(luakit::get_buff());
+        kit_state.new_class<keydict>(
+            "version", &keydict::version,
+            "size", &keydict::size,
+            "keys", &keydict::keys,
+            "learn", &keydict::learn,
+            "encode", &keydict::encode,
+            "decode", &keydict::decode,
+            "tobson", &keydict::tobson,
+            "frombson", &keydict::frombson
+        );
+        kit_state.new_class<bson_dump>(
+            "size", &bson_dump::size,
+            "tell", &bson_dump::tell,
+            "next", &bson_dump::next,
+            "next_raw", &bson_dump::next_raw,
+            "seek", &bson_dump::seek,
+            "count", &bson_dump::count,
+            "close", &bson_dump::close,
+            "save_index", &bson_dump::save_index,
+            "load_index", &bson_dump::load_index
+        );
+        kit_state.new_class<bson_matcher>(
+            "match", &bson_matcher::match,
+            "compare", &bson_matcher::compare,
+            "filter", &bson_matcher::filter
+        );
         auto llbson = kit_state.new_table("bson");
         llbson.set_function("mongocodec", mongo_codec);
         llbson.set_function("objectid", objectid);
@@ -59,6 +129,12 @@ namespace lbson {
         llbson.set_function("pairs", pairs);
         llbson.set_function("regex", regex);
         llbson.set_function("date", date);
+        llbson.set_function("diff", diff);
+        llbson.set_function("get", get);
+        llbson.set_function("set", set);
+        llbson.set_function("keydict", new_keydict);
+        llbson.set_function("open_dump", open_dump);
+        llbson.set_function("matcher", new_matcher);
         llbson.new_enum("BSON_TYPE",
             "BSON_EOO", bson_type::BSON_EOO,
             "BSON_REAL", bson_type::BSON_REAL,
@@ -0,0 +1,617 @@
+#pragma once
+
+#include <cmath>
+#include <memory>
+#include <algorithm>
+
+#include "bson.h"
+
+//在编码后的bson上执行MongoDB风格的过滤和排序，只解码命中的文档
+namespace lbson {
+    enum class match_op : uint8_t {
+        MATCH_AND,
+        MATCH_OR,
+        MATCH_NOR,
+        MATCH_EQ,
+        MATCH_NE,
+        MATCH_GT,
+        MATCH_GTE,
+        MATCH_LT,
+        MATCH_LTE,
+        MATCH_IN,
+        MATCH_NIN,
+        MATCH_EXISTS,
+    };
+
+    struct match_node {
+        match_op op;
+        bson_element value;
+        vector<string> path;
+        vector<match_node> children;
+    };
+
+    struct sort_field {
+        int order;
+        vector<string> path;
+    };
+
+    //https://www.mongodb.com/docs/manual/reference/bson-type-comparison-order/
+    inline int bson_type_rank(bson_type type) {
+        switch (type) {
+        case bson_type::BSON_MINKEY: return 1;
+        case bson_type::BSON_UNDEFINED:
+        case bson_type::BSON_NULL: return 2;
+        case bson_type::BSON_REAL:
+        case bson_type::BSON_INT32:
+        case bson_type::BSON_INT64:
+        case bson_type::BSON_INT128: return 3;
+        case bson_type::BSON_SYMBOL:
+        case bson_type::BSON_STRING: return 4;
+        case bson_type::BSON_DOCUMENT: return 5;
+        case bson_type::BSON_ARRAY: return 6;
+        case bson_type::BSON_BINARY: return 7;
+        case bson_type::BSON_OBJECTID: return 8;
+        case bson_type::BSON_BOOLEAN: return 9;
+        case bson_type::BSON_DATE: return 10;
+        case bson_type::BSON_TIMESTAMP: return 11;
+        case bson_type::BSON_REGEX: return 12;
+        case bson_type::BSON_DBPOINTER: return 13;
+        case bson_type::BSON_JSCODE: return 14;
+        case bson_type::BSON_CODEWS: return 15;
+        case bson_type::BSON_MAXKEY: return 16;
+        default: return 0;
+        }
+    }
+
+    inline int compare_value(const bson_element& a, const bson_element& b);
+
+    template<typename T>
+    inline int compare_raw(T a, T b) {
+        return a < b ? -1 : (a > b ? 1 : 0);
+    }
+
+    inline int compare_bytes(const uint8_t* a, size_t alen, const uint8_t* b, size_t blen) {
+        int ret = memcmp(a, b, min(alen, blen));
+        if (ret != 0) return ret < 0 ? -1 : 1;
+        return compare_raw(alen, blen);
+    }
+
+    inline double number_value(const bson_element& elem) {
+        switch (elem.type) {
+        case bson_type::BSON_INT32: return read_raw<int32_t>(elem.value);
+        case bson_type::BSON_INT64: return read_raw<int64_t>(elem.value);
+        default: return read_raw<double>(elem.value);
+        }
+    }
+
+    inline bool is_decimal(const bson_element& elem) {
+        return elem.type == bson_type::BSON_INT128;
+    }
+
+    inline int64_t integer_value(const bson_element& elem) {
+        return elem.type == bson_type::BSON_INT32 ? read_raw<int32_t>(elem.value) : read_raw<int64_t>(elem.value);
+    }
+
+    //int64与double精确比较，不经过浮点转换(2^53以上的整数转double会丢失精度)
+    inline int compare_int_double(int64_t x, double y) {
+        //NaN小于所有数字
+        if (std::isnan(y)) return 1;
+        if (y >= 9223372036854775808.0) return -1;
+        if (y < -9223372036854775808.0) return 1;
+        double yint = std::trunc(y);
+        int64_t n = (int64_t)yint;
+        if (x != n) return x < n ? -1 : 1;
+        return compare_raw(0.0, y - yint);
+    }
+
+    inline int compare_number(const bson_element& a, const bson_element& b) {
+        if (is_decimal(a) || is_decimal(b)) {
+            //decimal128没有数值解码：字节相同视为相等，否则排在其他数字之后，不代表数值大小
+            //matcher在顶层的比较和排序中跳过decimal128，这里只影响嵌套文档的比较
+            if (is_decimal(a) != is_decimal(b)) return is_decimal(a) ? 1 : -1;
+            return compare_bytes(a.value, a.len, b.value, b.len);
+        }
+        bool aint = a.type != bson_type::BSON_REAL;
+        bool bint = b.type != bson_type::BSON_REAL;
+        if (aint && bint) {
+            return compare_raw(integer_value(a), integer_value(b));
+        }
+        if (aint) return compare_int_double(integer_value(a), read_raw<double>(b.value));
+        if (bint) return -compare_int_double(integer_value(b), read_raw<double>(a.value));
+        double x = read_raw<double>(a.value), y = read_raw<double>(b.value);
+        bool xnan = std::isnan(x), ynan = std::isnan(y);
+        if (xnan || ynan) return xnan == ynan ? 0 : (xnan ? -1 : 1);
+        return compare_raw(x, y);
+    }
+
+    //文档和数组逐字段比较：类型、字段名、值
+    inline int compare_dict(const bson_element& a, const bson_element& b) {
+        bson_element x, y;
+        bson_iter xiter(a.value, a.len), yiter(b.value, b.len);
+        while (true) {
+            bool xnext = xiter.next(x), ynext = yiter.next(y);
+            if (!xnext || !ynext) return compare_raw(xnext, ynext);
+            int ret = compare_raw(bson_type_rank(x.type), bson_type_rank(y.type));
+            if (ret != 0) return ret;
+            ret = compare_bytes((const uint8_t*)x.key.data(), x.key.size(), (const uint8_t*)y.key.data(), y.key.size());
+            if (ret != 0) return ret;
+            ret = compare_value(x, y);
+            if (ret != 0) return ret;
+        }
+    }
+
+    inline int compare_value(const bson_element& a, const bson_element& b) {
+        int ret = compare_raw(bson_type_rank(a.type), bson_type_rank(b.type));
+        if (ret != 0) return ret;
+        switch (a.type) {
+        case bson_type::BSON_REAL:
+        case bson_type::BSON_INT32:
+        case bson_type::BSON_INT64:
+        case bson_type::BSON_INT128:
+            return compare_number(a, b);
+        case bson_type::BSON_STRING:
+        case bson_type::BSON_SYMBOL:
+        case bson_type::BSON_JSCODE:
+            return compare_bytes(a.value + 4, a.len - 5, b.value + 4, b.len - 5);
+        case bson_type::BSON_DOCUMENT:
+        case bson_type::BSON_ARRAY:
+            return compare_dict(a, b);
+        case bson_type::BSON_BINARY:
+            //先比较长度，再比较子类型和内容
+            ret = compare_raw(a.len, b.len);
+            if (ret != 0) return ret;
+            ret = compare_raw(a.value[4], b.value[4]);
+            if (ret != 0) return ret;
+            return compare_bytes(a.value + 5, a.len - 5, b.value + 5, b.len - 5);
+        case bson_type::BSON_BOOLEAN:
+            return compare_raw(a.value[0] != 0, b.value[0] != 0);
+        case bson_type::BSON_DATE:
+            return compare_raw(read_raw<int64_t>(a.value), read_raw<int64_t>(b.value));
+        case bson_type::BSON_TIMESTAMP:
+            return compare_raw(read_raw<uint64_t>(a.value), read_raw<uint64_t>(b.value));
+        case bson_type::BSON_MINKEY:
+        case bson_type::BSON_MAXKEY:
+        case bson_type::BSON_NULL:
+        case bson_type::BSON_UNDEFINED:
+            return 0;
+        default:
+            return compare_bytes(a.value, a.len, b.value, b.len);
+        }
+    }
+
+    class bson_matcher {
+    public:
+        void set_bson(bson* bson) {
+            m_bson = bson;
+        }
+
+        //会直接抛出lua错误的参数检查和编码，在分配matcher之前完成
+        static void check_args(lua_State* L, bson* bson, int findex, int sindex) {
+            size_t len = 0;
+            if (lua_type(L, findex) == LUA_TTABLE) {
+                string hold;
+                bson->diff_source(L, findex, hold, len);
+                lua_pushlstring(L, hold.data(), hold.size());
+                lua_replace(L, findex);
+            } else if (!lua_isnoneornil(L, findex)) {
+                bson->check_document(L, findex, len);
+            }
+            if (!lua_isnoneornil(L, sindex) && lua_type(L, sindex) != LUA_TTABLE) {
+                bson->check_document(L, sindex, len);
+            }
+        }
+
+        //matcher(filter, [sort])，filter为lua表或编码后的bson
+        //sort为{"field", 1, "field2", -1}形式的有序对，或bson.pairs的结果
+        void compile(lua_State* L, int findex, int sindex) {
+            m_root.op = match_op::MATCH_AND;
+            if (!lua_isnoneornil(L, findex)) {
+                size_t len = 0;
+                const uint8_t* doc = m_bson->diff_source(L, findex, m_filter, len);
+                if (doc != (const uint8_t*)m_filter.data()) {
+                    m_filter.assign((const char*)doc, len);
+                }
+                compile_dict((const uint8_t*)m_filter.data(), m_filter.size(), m_root);
+            }
+            if (lua_type(L, sindex) == LUA_TTABLE && lua_rawlen(L, sindex) == 0) {
+                //单字段排序可以直接使用{field = 1}，多字段时lua表无序，必须使用有序对
+                lua_pushnil(L);
+                while (lua_next(L, sindex) != 0) {
+                    size_t klen = 0;
+                    if (lua_type(L, -2) != LUA_TSTRING) throw lua_exception("sort field need a string");
+                    if (!m_sorts.empty()) throw lua_exception("sort with multiple fields need ordered pairs");
+                    const char* key = lua_tolstring(L, -2, &klen);
+                    add_sort(string_view(key, klen), sort_order(L, -1, key));
+                    lua_pop(L, 1);
+                }
+            } else if (lua_type(L, sindex) == LUA_TTABLE) {
+                size_t len = lua_rawlen(L, sindex);
+                for (size_t i = 1; i + 1 <= len; i += 2) {
+                    size_t klen = 0;
+                    lua_rawgeti(L, sindex, i);
+                    const char* key = lua_tolstring(L, -1, &klen);
+                    if (key == nullptr) throw lua_exception("sort field %d need a string", (int)i);
+                    lua_rawgeti(L, sindex, i + 1);
+                    add_sort(string_view(key, klen), sort_order(L, -1, key));
+                    lua_pop(L, 2);
+                }
+            } else if (!lua_isnoneornil(L, sindex)) {
+                size_t len = 0;
+                bson_element elem;
+                const uint8_t* doc = m_bson->check_document(L, sindex, len);
+                bson_iter iter(doc, len);
+                while (iter.next(elem)) {
+                    add_sort(elem.key, sort_order(elem));
+                }
+            }
+        }
+
+        int match(lua_State* L) {
+            size_t len = 0;
+            const uint8_t* doc = m_bson->check_document(L, 2, len);
+            bool matched = false;
+            try {
+                matched = eval(m_root, doc, len);
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            lua_pushboolean(L, matched);
+            return 1;
+        }
+
+        //按排序规则比较两个编码后的文档，返回-1/0/1
+        int compare(lua_State* L) {
+            size_t alen = 0, blen = 0;
+            const uint8_t* a = m_bson->check_document(L, 2, alen);
+            const uint8_t* b = m_bson->check_document(L, 3, blen);
+            int ret = 0;
+            try {
+                vector<bson_element> akeys, bkeys;
+                sort_keys(a, alen, akeys);
+                sort_keys(b, blen, bkeys);
+                ret = compare_keys(akeys.data(), bkeys.data());
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            lua_pushinteger(L, ret);
+            return 1;
+        }
+
+        //matcher:filter(docs, [raw], [limit])
+        //过滤并排序编码后的文档列表，只解码命中的文档，raw为true时返回原始编码
+        //decimal128字段只支持字节相同的等值匹配，范围比较视为不匹配，排序时视为null
+        int filter(lua_State* L) {
+            luaL_checktype(L, 2, LUA_TTABLE);
+            bool raw = lua_toboolean(L, 3);
+            size_t limit = (size_t)luaL_optinteger(L, 4, 0);
+            size_t count = lua_rawlen(L, 2);
+            size_t nsort = m_sorts.size();
+            //容器为成员变量，luaL_error跳出时不会泄漏，并在多次调用间复用
+            auto& hits = m_hits;
+            auto& keys = m_keys;
+            auto& docs = m_docs;
+            hits.clear();
+            keys.clear();
+            docs.resize(count);
+            for (size_t i = 0; i < count; ++i) {
+                lua_rawgeti(L, 2, i + 1);
+                docs[i].first = m_bson->check_document(L, -1, docs[i].second);
+                lua_pop(L, 1);
+            }
+            try {
+                for (size_t i = 0; i < count; ++i) {
+                    if (!eval(m_root, docs[i].first, docs[i].second)) continue;
+                    hits.push_back(i);
+                    if (nsort > 0) {
+                        sort_keys(docs[i].first, docs[i].second, keys);
+                    } else if (limit > 0 && hits.size() >= limit) {
+                        break;
+                    }
+                }
+                if (nsort > 0) {
+                    vector<size_t> order(hits.size());
+                    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+                    auto less = [&](size_t a, size_t b) {
+                        return compare_keys(&keys[a * nsort], &keys[b * nsort]) < 0;
+                    };
+                    if (limit > 0 && limit < order.size()) {
+                        partial_sort(order.begin(), order.begin() + limit, order.end(), less);
+                        order.resize(limit);
+                    } else {
+                        stable_sort(order.begin(), order.end(), less);
+                    }
+                    for (size_t i = 0; i < order.size(); ++i) order[i] = hits[order[i]];
+                    hits.swap(order);
+                }
+            } catch (const exception& e){
+                luaL_error(L, "%s", e.what());
+            }
+            lua_createtable(L, hits.size(), 0);
+            for (size_t i = 0; i < hits.size(); ++i) {
+                if (raw) {
+                    lua_rawgeti(L, 2, hits[i] + 1);
+                } else {
+                    try {
+                        slice slice((uint8_t*)docs[hits[i]].first, docs[hits[i]].second);
+                        m_bson->unpack_dict(L, &slice, false);
+                    } catch (const exception& e){
+                        luaL_error(L, "%s", e.what());
+                    }
+                }
+                lua_rawseti(L, -2, i + 1);
+            }
+            return 1;
+        }
+
+    protected:
+        vector<string> split_path(string_view path) {
+            vector<string> segs;
+            size_t start = 0;
+            while (true) {
+                size_t dot = path.find('.', start);
+                if (dot == string_view::npos) {
+                    segs.emplace_back(path.substr(start));
+                    return segs;
+                }
+                segs.emplace_back(path.substr(start, dot - start));
+                start = dot + 1;
+            }
+        }
+
+        int sort_order(lua_State* L, int index, const char* key) {
+            if (lua_type(L, index) != LUA_TNUMBER) {
+                throw lua_exception("invalid sort order for field: %s", key);
+            }
+            return lua_tonumber(L, index) < 0 ? -1 : 1;
+        }
+
+        int sort_order(const bson_element& elem) {
+            switch (elem.type) {
+            case bson_type::BSON_INT32: return read_raw<int32_t>(elem.value) < 0 ? -1 : 1;
+            case bson_type::BSON_INT64: return read_raw<int64_t>(elem.value) < 0 ? -1 : 1;
+            case bson_type::BSON_REAL: return read_raw<double>(elem.value) < 0 ? -1 : 1;
+            default: throw lua_exception("invalid sort order for field: %s", string(elem.key).c_str());
+            }
+        }
+
+        void add_sort(string_view key, int order) {
+            m_sorts.push_back({ order, split_path(key) });
+        }
+
+        bool is_truthy(const bson_element& elem) {
+            switch (elem.type) {
+            case bson_type::BSON_BOOLEAN: return elem.value[0] != 0;
+            case bson_type::BSON_INT32:
+            case bson_type::BSON_INT64:
+            case bson_type::BSON_REAL: return number_value(elem) != 0;
+            case bson_type::BSON_NULL:
+            case bson_type::BSON_UNDEFINED: return false;
+            default: return true;
+            }
+        }
+
+        void compile_dict(const uint8_t* doc, size_t len, match_node& parent) {
+            bson_element elem;
+            bson_iter iter(doc, len);
+            while (iter.next(elem)) {
+                if (!elem.key.empty() && elem.key[0] == '$') {
+                    compile_logic(elem, parent);
+                } else {
+                    compile_field(elem, parent);
+                }
+            }
+        }
+
+        void compile_logic(const bson_element& elem, match_node& parent) {
+            match_node node;
+            if (elem.key == "$and") node.op = match_op::MATCH_AND;
+            else if (elem.key == "$or") node.op = match_op::MATCH_OR;
+            else if (elem.key == "$nor") node.op = match_op::MATCH_NOR;
+            else throw lua_exception("unsupported match operator: %s", string(elem.key).c_str());
+            if (elem.type != bson_type::BSON_ARRAY) {
+                throw lua_exception("%s need an array", string(elem.key).c_str());
+            }
+            bson_element sub;
+            bson_iter iter(elem.value, elem.len);
+            while (iter.next(sub)) {
+                if (sub.type != bson_type::BSON_DOCUMENT) {
+                    throw lua_exception("%s need an array of documents", string(elem.key).c_str());
+                }
+                match_node child;
+                child.op = match_op::MATCH_AND;
+                compile_dict(sub.value, sub.len, child);
+                node.children.push_back(move(child));
+            }
+            if (node.children.empty()) {
+                throw lua_exception("%s need a nonempty array", string(elem.key).c_str());
+            }
+            parent.children.push_back(move(node));
+        }
+
+        bool is_operator_dict(const bson_element& elem) {
+            if (elem.type != bson_type::BSON_DOCUMENT) return false;
+            bson_element sub;
+            bson_iter iter(elem.value, elem.len);
+            return iter.next(sub) && !sub.key.empty() && sub.key[0] == '$';
+        }
+
+        void compile_field(const bson_element& elem, match_node& parent) {
+            vector<string> path = split_path(elem.key);
+            if (!is_operator_dict(elem)) {
+                parent.children.push_back({ match_op::MATCH_EQ, elem, path, {} });
+                return;
+            }
+            bson_element sub;
+            bson_iter iter(elem.value, elem.len);
+            while (iter.next(sub)) {
+                match_op op;
+                if (sub.key == "$eq") op = match_op::MATCH_EQ;
+                else if (sub.key == "$ne") op = match_op::MATCH_NE;
+                else if (sub.key == "$gt") op = match_op::MATCH_GT;
+                else if (sub.key == "$gte") op = match_op::MATCH_GTE;
+                else if (sub.key == "$lt") op = match_op::MATCH_LT;
+                else if (sub.key == "$lte") op = match_op::MATCH_LTE;
+                else if (sub.key == "$in") op = match_op::MATCH_IN;
+                else if (sub.key == "$nin") op = match_op::MATCH_NIN;
+                else if (sub.key == "$exists") op = match_op::MATCH_EXISTS;
+                else throw lua_exception("unsupported match operator: %s", string(sub.key).c_str());
+                if ((op == match_op::MATCH_IN || op == match_op::MATCH_NIN) && sub.type != bson_type::BSON_ARRAY) {
+                    throw lua_exception("%s need an array", string(sub.key).c_str());
+                }
+                parent.children.push_back({ op, sub, path, {} });
+            }
+        }
+
+        //按路径收集候选值，数组展开其元素(MongoDB数组匹配语义)
+        bool resolve(const uint8_t* doc, size_t len, const vector<string>& path, size_t index, vector<bson_element>& out, bool expand) {
+            bson_element elem;
+            bson_iter iter(doc, len);
+            bool found = false;
+            while (iter.next(elem)) {
+                if (elem.key != path[index]) continue;
+                found = true;
+                break;
+            }
+            bool exists = false;
+            if (found) {
+                exists = true;
+                if (index + 1 == path.size()) {
+                    if (elem.type != bson_type::BSON_ARRAY || expand) out.push_back(elem);
+                    if (elem.type == bson_type::BSON_ARRAY) {
+                        bson_element sub;
+                        bson_iter aiter(elem.value, elem.len);
+                        while (aiter.next(sub)) out.push_back(sub);
+                    }
+                    return true;
+                }
+                if (elem.type == bson_type::BSON_DOCUMENT) {
+                    return resolve(elem.value, elem.len, path, index + 1, out, expand);
+                }
+                if (elem.type != bson_type::BSON_ARRAY) {
+                    return false;
+                }
+                //数组既可以按下标访问，也对每个子文档继续匹配
+                exists = resolve(elem.value, elem.len, path, index + 1, out, expand);
+                bson_element sub;
+                bson_iter aiter(elem.value, elem.len);
+                while (aiter.next(sub)) {
+                    if (sub.type == bson_type::BSON_DOCUMENT) {
+                        exists |= resolve(sub.value, sub.len, path, index + 1, out, expand);
+                    }
+                }
+            }
+            return exists;
+        }
+
+        //decimal128只在字节相同时相等
+        bool match_any(const vector<bson_element>& values, const bson_element& target) {
+            for (auto& value : values) {
+                if (is_decimal(value) || is_decimal(target)) {
+                    if (bson_equal(value, target)) return true;
+                } else if (compare_value(value, target) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool match_eq(const vector<bson_element>& values, bool exists, const bson_element& target) {
+            //{field: null}同时匹配不存在的字段
+            if (!exists && bson_type_rank(target.type) == bson_type_rank(bson_type::BSON_NULL)) return true;
+            return match_any(values, target);
+        }
+
+        bool match_in(const vector<bson_element>& values, bool exists, const bson_element& target) {
+            bson_element sub;
+            bson_iter iter(target.value, target.len);
+            while (iter.next(sub)) {
+                if (match_eq(values, exists, sub)) return true;
+            }
+            return false;
+        }
+
+        bool match_cmp(const vector<bson_element>& values, match_op op, const bson_element& target) {
+            int rank = bson_type_rank(target.type);
+            for (auto& value : values) {
+                //只在同一类型区间内比较，decimal128无法比较大小，视为不匹配
+                if (bson_type_rank(value.type) != rank || is_decimal(value) || is_decimal(target)) continue;
+                int ret = compare_value(value, target);
+                switch (op) {
+                case match_op::MATCH_GT: if (ret > 0) return true; break;
+                case match_op::MATCH_GTE: if (ret >= 0) return true; break;
+                case match_op::MATCH_LT: if (ret < 0) return true; break;
+                case match_op::MATCH_LTE: if (ret <= 0) return true; break;
+                default: break;
+                }
+            }
+            return false;
+        }
+
+        bool eval(const match_node& node, const uint8_t* doc, size_t len) {
+            switch (node.op) {
+            case match_op::MATCH_AND:
+                for (auto& child : node.children) {
+                    if (!eval(child, doc, len)) return false;
+                }
+                return true;
+            case match_op::MATCH_OR:
+                for (auto& child : node.children) {
+                    if (eval(child, doc, len)) return true;
+                }
+                return false;
+            case match_op::MATCH_NOR:
+                for (auto& child : node.children) {
+                    if (eval(child, doc, len)) return false;
+                }
+                return true;
+            default:
+                break;
+            }
+            m_values.clear();
+            bool exists = resolve(doc, len, node.path, 0, m_values, true);
+            switch (node.op) {
+            case match_op::MATCH_EQ: return match_eq(m_values, exists, node.value);
+            case match_op::MATCH_NE: return !match_eq(m_values, exists, node.value);
+            case match_op::MATCH_IN: return match_in(m_values, exists, node.value);
+            case match_op::MATCH_NIN: return !match_in(m_values, exists, node.value);
+            case match_op::MATCH_EXISTS: return exists == is_truthy(node.value);
+            default: return match_cmp(m_values, node.op, node.value);
+            }
+        }
+
+        //数组字段升序取最小元素，降序取最大元素，缺失字段和decimal128视为null
+        void sort_keys(const uint8_t* doc, size_t len, vector<bson_element>& keys) {
+            static const uint8_t empty = 0;
+            for (auto& field : m_sorts) {
+                m_values.clear();
+                resolve(doc, len, field.path, 0, m_values, false);
+                bool found = false;
+                bson_element key = { bson_type::BSON_NULL, string_view(), &empty, &empty, 0 };
+                for (auto& value : m_values) {
+                    if (is_decimal(value)) continue;
+                    if (!found || compare_value(value, key) * field.order < 0) key = value;
+                    found = true;
+                }
+                keys.push_back(key);
+            }
+        }
+
+        int compare_keys(const bson_element* a, const bson_element* b) {
+            for (size_t i = 0; i < m_sorts.size(); ++i) {
+                int ret = compare_value(a[i], b[i]) * m_sorts[i].order;
+                if (ret != 0) return ret;
+            }
+            return 0;
+        }
+
+    protected:
+        string m_filter;
+        match_node m_root;
+        bson* m_bson = nullptr;
+        vector<sort_field> m_sorts;
+        vector<size_t> m_hits;
+        vector<bson_element> m_keys;
+        vector<bson_element> m_values;
+        vector<pair<const uint8_t*, size_t>> m_docs;
+    };
+}